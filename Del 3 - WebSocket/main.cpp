@@ -2,6 +2,32 @@
 #include <restinio/all.hpp>
 #include <json_dto/pub.hpp>
 #include <vector>
+#include <array>
+#include <deque>
+#include <chrono>
+#include <map>
+#include <set>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <optional>
+#include <string_view>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <charconv>
+#include <fstream>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <restinio/websocket/websocket.hpp>
 
 #include <fmt/format.h>
@@ -11,8 +37,22 @@ using router_t = rr::express_router_t<>;
 
 // To handle WebSocket
 namespace rws = restinio::websocket::basic;
-using ws_registry_t = std::map<std::uint64_t, rws::ws_handle_t>;
-using traits_t = restinio::traits_t<restinio::asio_timer_manager_t, restinio::single_threaded_ostream_logger_t, router_t>;
+// WebSocket-client with the state used for heartbeats
+struct ws_client_t
+{
+    rws::ws_handle_t m_handle;
+    // Time of the last frame received from the client
+    std::chrono::steady_clock::time_point m_lastSeen;
+    // Time a ping was sent, while waiting for the pong
+    std::optional<std::chrono::steady_clock::time_point> m_pingSent;
+};
+using ws_registry_t = std::map<std::uint64_t, ws_client_t>;
+// The logger is shared by the acceptor threads, see main()
+struct traits_t : public restinio::traits_t<restinio::asio_timer_manager_t, restinio::shared_ostream_logger_t, router_t>
+{
+    // Enables max_parallel_connections() in main()
+    static constexpr bool use_connection_count_limiter = true;
+};
 
 // Implementation of struct weatherStation_t
 struct weatherStation_t
@@ -70,16 +110,1546 @@ struct weatherStation_t
 // Definition of vector for weatherStation_t
 using weatherStation_collection_t = std::vector<weatherStation_t>;
 
-// Class to handle weatherStation
-class weatherStation_handler_t
+// Records held by the handler. A record is replaced rather than changed, so a snapshot can share the records
+// by copying the pointers.
+using weatherStation_rows_t = std::vector<std::shared_ptr<const weatherStation_t>>;
+
+// Rows holding copies of the records
+inline weatherStation_rows_t to_rows(const weatherStation_collection_t &weatherStation)
+{
+    weatherStation_rows_t rows;
+    rows.reserve(weatherStation.size());
+    for (const auto & b : weatherStation)
+        rows.push_back(std::make_shared<const weatherStation_t>(b));
+    return rows;
+}
+
+// JSON-array of the records, the same as json_dto::to_json() of a weatherStation_collection_t
+inline std::string to_json(const weatherStation_rows_t &rows)
+{
+    std::string json{"["};
+    for (const auto & row : rows)
+    {
+        if (json.size() > 1)
+            json += ',';
+        json += json_dto::to_json(*row);
+    }
+    return json + ']';
+}
+
+// Implementation of struct change_t, one mutation of the collection stamped with a sequence number
+struct change_t
+{
+    change_t() = default;
+
+    // Constructor for change_t with members
+    change_t(
+        std::uint64_t Seq,
+        std::string Op,
+        std::uint32_t Index,
+        weatherStation_t Record)
+        : m_Seq{Seq},
+          m_Op{std::move(Op)},
+          m_Index{Index},
+          m_Record{std::move(Record)}
+    {}
+
+    // JSON I/O funktion to work with json_dto
+    template <typename JSON_IO>
+    void
+    json_io(JSON_IO &io)
+    {
+        io
+            & json_dto::mandatory("Seq", m_Seq)
+            & json_dto::mandatory("Op", m_Op)
+            & json_dto::mandatory("Index", m_Index)
+            & json_dto::mandatory("Record", m_Record);
+    }
+
+    // Members of struct change_t
+    std::uint64_t m_Seq;
+    // "POST", "PUT" or "DELETE"
+    std::string m_Op;
+    // Position (as used in '/:ID') the change was applied to
+    std::uint32_t m_Index;
+    weatherStation_t m_Record;
+};
+
+// Bounded in-memory log of the latest changes, used to replay missed updates to reconnecting WebSocket-clients
+class change_log_t
 {
 public:
-    explicit weatherStation_handler_t(weatherStation_collection_t &weatherStation)
-        : m_weatherStation(weatherStation)
+    explicit change_log_t(std::size_t capacity)
+        : m_capacity{capacity}
     {}
-	
-	weatherStation_handler_t( const weatherStation_handler_t & ) = delete;
-	weatherStation_handler_t( weatherStation_handler_t && ) = delete;
+
+    // Stamps a change with the next sequence number and stores it, dropping the oldest change when full
+    const change_t & append(std::string op, std::uint32_t index, weatherStation_t record)
+    {
+        m_changes.emplace_back(++m_lastSeq, std::move(op), index, std::move(record));
+        if (m_changes.size() > m_capacity)
+            m_changes.pop_front();
+
+        return m_changes.back();
+    }
+
+    // Sequence number of the latest change, 0 if nothing has changed yet
+    std::uint64_t last_seq() const { return m_lastSeq; }
+
+    // True if every change after seq is still in the log
+    bool covers(std::uint64_t seq) const
+    {
+        if (seq > m_lastSeq)
+            return false;
+
+        return seq == m_lastSeq || m_changes.front().m_Seq <= seq + 1;
+    }
+
+    // Returns all changes after seq, requires covers(seq)
+    std::vector<change_t> since(std::uint64_t seq) const
+    {
+        if (seq >= m_lastSeq)
+            return {};
+
+        const auto first = m_changes.begin() + (seq + 1 - m_changes.front().m_Seq);
+        return std::vector<change_t>(first, m_changes.end());
+    }
+
+private:
+    std::size_t m_capacity;
+    std::uint64_t m_lastSeq{0};
+    std::deque<change_t> m_changes;
+};
+
+// Sequence number together with the run of the server it belongs to, written as "<Run>-<Seq>".
+// Sequence numbers restart from 0 with the server, so a token from another run can't be resumed from.
+struct seq_token_t
+{
+    std::uint64_t m_run;
+    std::uint64_t m_seq;
+
+    std::string to_string() const { return fmt::format("{}-{}", m_run, m_seq); }
+
+    // Parses "<Run>-<Seq>", throws std::invalid_argument if text isn't one
+    static seq_token_t parse(const std::string &text)
+    {
+        seq_token_t token{};
+        const auto * end = text.data() + text.size();
+
+        const auto run = std::from_chars(text.data(), end, token.m_run);
+        if (run.ec != std::errc{} || run.ptr == end || *run.ptr != '-')
+            throw std::invalid_argument("invalid token: " + text);
+
+        const auto seq = std::from_chars(run.ptr + 1, end, token.m_seq);
+        if (seq.ec != std::errc{} || seq.ptr != end)
+            throw std::invalid_argument("invalid token: " + text);
+
+        return token;
+    }
+};
+
+// Per-record version stamps for delta-sync, kept in the same order as the collection.
+// Every record gets a stable key, which (unlike its position) doesn't change when another record is deleted.
+class record_versions_t
+{
+public:
+    explicit record_versions_t(std::size_t tombstone_capacity)
+        : m_tombstoneCapacity{tombstone_capacity}
+    {}
+
+    // Stamps a record appended to the collection.
+    // Version 0 is shared by the initial records and never listed as a change, so it isn't indexed.
+    void on_insert(std::uint64_t version)
+    {
+        m_keys.push_back(m_nextKey);
+        m_versions.push_back(version);
+        if (0 != version)
+            m_byVersion.emplace(version, m_nextKey);
+        ++m_nextKey;
+    }
+
+    // Restamps the record at pos (0-based)
+    void on_update(std::size_t pos, std::uint64_t version)
+    {
+        unindex(pos);
+        m_versions[pos] = version;
+        m_byVersion.emplace(version, m_keys[pos]);
+    }
+
+    // Removes the record at pos (0-based) and remembers its deletion
+    void on_erase(std::size_t pos, std::uint64_t version)
+    {
+        unindex(pos);
+        m_tombstones.emplace_back(version, m_keys[pos]);
+        m_keys.erase(m_keys.begin() + pos);
+        m_versions.erase(m_versions.begin() + pos);
+
+        // Deletions older than the horizon are forgotten, clients behind it must reset
+        if (m_tombstones.size() > m_tombstoneCapacity)
+        {
+            m_horizon = m_tombstones.front().first;
+            m_tombstones.pop_front();
+        }
+    }
+
+    // True if all deletions after version are still known
+    bool covers(std::uint64_t version) const { return version >= m_horizon; }
+
+    // Stable key of the record at pos (0-based)
+    std::uint64_t key(std::size_t pos) const { return m_keys[pos]; }
+
+    // Version stamp of the record at pos (0-based)
+    std::uint64_t version(std::size_t pos) const { return m_versions[pos]; }
+
+    // Calls on_upsert(pos, version) and on_delete(key, version) in version order for everything changed after version.
+    // Cost is proportional to the number of changes, not the size of the collection.
+    template <typename ON_UPSERT, typename ON_DELETE>
+    void for_each_since(std::uint64_t version, ON_UPSERT on_upsert, ON_DELETE on_delete) const
+    {
+        auto upsert = m_byVersion.upper_bound(version);
+        auto tombstone = std::upper_bound(
+            m_tombstones.begin(), m_tombstones.end(), version,
+            [](std::uint64_t v, const auto &t) { return v < t.first; });
+
+        while (upsert != m_byVersion.end() || tombstone != m_tombstones.end())
+        {
+            if (tombstone == m_tombstones.end() ||
+                (upsert != m_byVersion.end() && upsert->first < tombstone->first))
+            {
+                // Keys are handed out in insertion order, so m_keys is sorted
+                const auto pos = std::lower_bound(m_keys.begin(), m_keys.end(), upsert->second) - m_keys.begin();
+                on_upsert(static_cast<std::size_t>(pos), upsert->first);
+                ++upsert;
+            }
+            else
+            {
+                on_delete(tombstone->second, tombstone->first);
+                ++tombstone;
+            }
+        }
+    }
+
+private:
+    // Removes the record at pos (0-based) from m_byVersion
+    void unindex(std::size_t pos)
+    {
+        if (0 != m_versions[pos])
+            m_byVersion.erase(m_versions[pos]);
+    }
+
+    std::size_t m_tombstoneCapacity;
+    std::uint64_t m_nextKey{1};
+    std::uint64_t m_horizon{0};
+
+    // Stable key and version of each record, same order as the collection
+    std::vector<std::uint64_t> m_keys;
+    std::vector<std::uint64_t> m_versions;
+
+    // Version -> key of the live records
+    std::map<std::uint64_t, std::uint64_t> m_byVersion;
+
+    // (version, key) of deleted records, oldest first
+    std::deque<std::pair<std::uint64_t, std::uint64_t>> m_tombstones;
+};
+
+// Implementation of struct standingQuery_t, a condition evaluated for every new reading
+struct standingQuery_t
+{
+    // JSON I/O funktion to work with json_dto
+    template <typename JSON_IO>
+    void
+    json_io(JSON_IO &io)
+    {
+        io
+            & json_dto::optional("QueryID", m_QueryID, 0u)
+            & json_dto::mandatory("Kind", m_Kind)
+            & json_dto::mandatory("Field", m_Field)
+            & json_dto::mandatory("Op", m_Op)
+            & json_dto::mandatory("Value", m_Value)
+            & json_dto::optional("Station", m_Station, std::string{})
+            & json_dto::optional("Window", m_Window, 1u);
+    }
+
+    // Members of struct standingQuery_t
+    // Assigned by the server when registered
+    std::uint32_t m_QueryID{0};
+    // "threshold": the reading itself, "rate": absolute change since the station's previous reading,
+    // "window": average of the station's last Window readings
+    std::string m_Kind;
+    // "Temperature" or "Humidity in %"
+    std::string m_Field;
+    // ">" or "<"
+    std::string m_Op;
+    float m_Value{0};
+    // ID of the station to watch, empty for all stations
+    std::string m_Station;
+    std::uint32_t m_Window{1};
+};
+
+// Implementation of struct alert_t, sent to subscribed WebSocket-clients when a standing query fires
+struct alert_t
+{
+    // JSON I/O funktion to work with json_dto
+    template <typename JSON_IO>
+    void
+    json_io(JSON_IO &io)
+    {
+        io
+            & json_dto::mandatory("QueryID", m_QueryID)
+            & json_dto::mandatory("Station", m_Station)
+            & json_dto::mandatory("Field", m_Field)
+            & json_dto::mandatory("Value", m_Value)
+            & json_dto::mandatory("Record", m_Record);
+    }
+
+    // Members of struct alert_t
+    std::uint32_t m_QueryID;
+    std::string m_Station;
+    std::string m_Field;
+    // The value that made the condition hold
+    float m_Value;
+    weatherStation_t m_Record;
+};
+
+// Incremental evaluation of standing queries. Each query keeps a small state per station,
+// so the cost per reading doesn't depend on how many readings are stored.
+class alert_engine_t
+{
+public:
+    // Registers a query and returns its QueryID, throws std::invalid_argument if it isn't valid
+    std::uint32_t add(standingQuery_t query)
+    {
+        if (query.m_Kind != "threshold" && query.m_Kind != "rate" && query.m_Kind != "window")
+            throw std::invalid_argument("unknown Kind: " + query.m_Kind);
+        if (query.m_Field != "Temperature" && query.m_Field != "Humidity in %")
+            throw std::invalid_argument("unknown Field: " + query.m_Field);
+        if (query.m_Op != ">" && query.m_Op != "<")
+            throw std::invalid_argument("unknown Op: " + query.m_Op);
+        if (0 == query.m_Window || query.m_Window > max_window)
+            throw std::invalid_argument("Window out of range");
+
+        query.m_QueryID = ++m_lastQueryID;
+        m_queries.emplace(m_lastQueryID, entry_t{std::move(query), {}, {}});
+
+        return m_lastQueryID;
+    }
+
+    // Removes a query, returns false if it doesn't exist
+    bool remove(std::uint32_t queryID) { return 0 != m_queries.erase(queryID); }
+
+    // All registered queries
+    std::vector<standingQuery_t> queries() const
+    {
+        std::vector<standingQuery_t> result;
+        for (const auto & [id, e] : m_queries)
+            result.push_back(e.m_query);
+
+        return result;
+    }
+
+    // Subscribes a WebSocket-connection to the alerts of a query, returns false if it doesn't exist
+    bool subscribe(std::uint32_t queryID, std::uint64_t connection)
+    {
+        auto it = m_queries.find(queryID);
+        if (it == m_queries.end())
+            return false;
+
+        it->second.m_subscribers.insert(connection);
+        return true;
+    }
+
+    void unsubscribe(std::uint32_t queryID, std::uint64_t connection)
+    {
+        auto it = m_queries.find(queryID);
+        if (it != m_queries.end())
+            it->second.m_subscribers.erase(connection);
+    }
+
+    // Removes a closed WebSocket-connection from all queries
+    void remove_connection(std::uint64_t connection)
+    {
+        for (auto & [id, e] : m_queries)
+            e.m_subscribers.erase(connection);
+    }
+
+    // Feeds a new reading to all queries and calls on_alert(query, subscribers, value)
+    // for each query whose condition starts to hold for the reading's station.
+    template <typename ON_ALERT>
+    void evaluate(const weatherStation_t &reading, ON_ALERT on_alert)
+    {
+        for (auto & [id, e] : m_queries)
+        {
+            const auto & q = e.m_query;
+            if (!q.m_Station.empty() && q.m_Station != reading.m_ID)
+                continue;
+
+            const float sample = q.m_Field == "Temperature" ?
+                reading.m_Temperature : static_cast<float>(reading.m_Humidity);
+
+            auto & st = e.m_stations[reading.m_ID];
+
+            // Value the condition is tested on, if there is enough history
+            std::optional<float> value;
+            if (q.m_Kind == "threshold")
+            {
+                value = sample;
+            }
+            else if (q.m_Kind == "rate")
+            {
+                if (st.m_hasLast)
+                    value = std::fabs(sample - st.m_last);
+            }
+            else
+            {
+                st.m_window.push_back(sample);
+                st.m_sum += sample;
+                if (st.m_window.size() > q.m_Window)
+                {
+                    st.m_sum -= st.m_window.front();
+                    st.m_window.pop_front();
+                }
+                if (st.m_window.size() == q.m_Window)
+                    value = static_cast<float>(st.m_sum / q.m_Window);
+            }
+            st.m_last = sample;
+            st.m_hasLast = true;
+
+            const bool holds = value && (q.m_Op == ">" ? *value > q.m_Value : *value < q.m_Value);
+
+            // Alerts only when the condition starts to hold, not for every reading while it holds
+            if (holds && !st.m_firing && !e.m_subscribers.empty())
+                on_alert(q, e.m_subscribers, *value);
+            st.m_firing = holds;
+        }
+    }
+
+private:
+    // Largest Window accepted, bounds the memory per station
+    static constexpr std::uint32_t max_window = 1024;
+
+    // State of a query for one station
+    struct station_state_t
+    {
+        float m_last{0};
+        bool m_hasLast{false};
+        bool m_firing{false};
+        std::deque<float> m_window;
+        double m_sum{0};
+    };
+
+    struct entry_t
+    {
+        standingQuery_t m_query;
+        std::set<std::uint64_t> m_subscribers;
+        std::unordered_map<std::string, station_state_t> m_stations;
+    };
+
+    std::uint32_t m_lastQueryID{0};
+    std::map<std::uint32_t, entry_t> m_queries;
+};
+
+// Numeric columns of the collection, kept in the same order, so filters can scan contiguous memory.
+// Strings are dictionary-encoded into codes.
+class weatherStation_columns_t
+{
+public:
+    std::vector<float> m_temperature;
+    std::vector<std::int32_t> m_humidity;
+    // m_Date as a number (YYYYMMDD), INT32_MIN if it isn't a number
+    std::vector<std::int32_t> m_date;
+    std::vector<std::int32_t> m_placeName;
+    std::vector<std::int32_t> m_id;
+
+    void push_back(const weatherStation_t &b)
+    {
+        m_temperature.push_back(b.m_Temperature);
+        m_humidity.push_back(b.m_Humidity);
+        m_date.push_back(to_date(b.m_Date));
+        m_placeName.push_back(encode(b.m_PlaceName));
+        m_id.push_back(encode(b.m_ID));
+    }
+
+    void assign(std::size_t pos, const weatherStation_t &b)
+    {
+        m_temperature[pos] = b.m_Temperature;
+        m_humidity[pos] = b.m_Humidity;
+        m_date[pos] = to_date(b.m_Date);
+        m_placeName[pos] = encode(b.m_PlaceName);
+        m_id[pos] = encode(b.m_ID);
+    }
+
+    void erase(std::size_t pos)
+    {
+        m_temperature.erase(m_temperature.begin() + pos);
+        m_humidity.erase(m_humidity.begin() + pos);
+        m_date.erase(m_date.begin() + pos);
+        m_placeName.erase(m_placeName.begin() + pos);
+        m_id.erase(m_id.begin() + pos);
+    }
+
+    std::size_t size() const { return m_temperature.size(); }
+
+    // Code of a string, -1 if no record has it
+    std::int32_t code(const std::string &value) const
+    {
+        auto it = m_codes.find(value);
+        return it == m_codes.end() ? -1 : it->second;
+    }
+
+    // Date string as a number, INT32_MIN if it isn't one
+    static std::int32_t to_date(const std::string &date)
+    {
+        if (date.empty() || date.size() > 9 ||
+            !std::all_of(date.begin(), date.end(), [](unsigned char c) { return std::isdigit(c); }))
+            return INT32_MIN;
+
+        return static_cast<std::int32_t>(std::stol(date));
+    }
+
+private:
+    std::unordered_map<std::string, std::int32_t> m_codes;
+
+    std::int32_t encode(const std::string &value)
+    {
+        return m_codes.emplace(value, static_cast<std::int32_t>(m_codes.size())).first->second;
+    }
+};
+
+// A filter expression compiled once into a tree of column comparisons, e.g.
+//   Temperature > 20 and PlaceName = "Aarhus N" and Date >= 20231201
+// Fields: Temperature, Humidity, Date, PlaceName, ID. Operators: = != < <= > >=, and, or, not, ( ).
+class query_plan_t
+{
+public:
+    // Parses an expression, throws std::invalid_argument if it isn't valid
+    static std::shared_ptr<const query_plan_t> compile(const std::string &expression)
+    {
+        parser_t parser{expression};
+        auto plan = std::make_shared<query_plan_t>();
+        plan->m_root = parser.parse_or(*plan);
+        parser.expect_end();
+
+        return plan;
+    }
+
+    // Returns the positions (0-based) of the matching rows
+    std::vector<std::size_t> evaluate(const weatherStation_columns_t &columns) const
+    {
+        // String literals are looked up on every run, as the dictionary grows after compiling
+        std::vector<std::int32_t> codes(m_nodes.size());
+        for (std::size_t i = 0; i < m_nodes.size(); ++i)
+            if (m_nodes[i].m_column == column_t::placeName || m_nodes[i].m_column == column_t::id)
+                codes[i] = columns.code(m_nodes[i].m_string);
+
+        std::vector<std::size_t> result;
+        std::vector<std::uint8_t> masks(m_nodes.size() * batch_size);
+
+        for (std::size_t begin = 0; begin < columns.size(); begin += batch_size)
+        {
+            const auto n = std::min(batch_size, columns.size() - begin);
+            const auto * mask = evaluate_node(m_root, columns, codes, begin, n, masks.data());
+
+            for (std::size_t i = 0; i < n; ++i)
+                if (mask[i])
+                    result.push_back(begin + i);
+        }
+
+        return result;
+    }
+
+private:
+    // Rows evaluated at a time, small enough for the masks to stay in the cache
+    static constexpr std::size_t batch_size = 1024;
+
+    enum class column_t { none, temperature, humidity, date, placeName, id };
+    enum class op_t { eq, ne, lt, le, gt, ge, and_, or_, not_ };
+
+    struct node_t
+    {
+        op_t m_op;
+        column_t m_column{column_t::none};
+        float m_float{0};
+        std::int32_t m_int{0};
+        std::string m_string{};
+        std::size_t m_left{0};
+        std::size_t m_right{0};
+    };
+
+    std::vector<node_t> m_nodes;
+    std::size_t m_root{0};
+
+    std::size_t add(node_t node)
+    {
+        m_nodes.push_back(std::move(node));
+        return m_nodes.size() - 1;
+    }
+
+    // Evaluates node for rows [begin, begin + n) into its own slice of masks, 0xFF for a match
+    const std::uint8_t * evaluate_node(
+        std::size_t index, const weatherStation_columns_t &columns,
+        const std::vector<std::int32_t> &codes, std::size_t begin, std::size_t n,
+        std::uint8_t *masks) const
+    {
+        const auto & node = m_nodes[index];
+        auto * out = masks + index * batch_size;
+
+        switch (node.m_op)
+        {
+        case op_t::and_:
+        case op_t::or_:
+        {
+            const auto * l = evaluate_node(node.m_left, columns, codes, begin, n, masks);
+            const auto * r = evaluate_node(node.m_right, columns, codes, begin, n, masks);
+            if (node.m_op == op_t::and_)
+                for (std::size_t i = 0; i < n; ++i) out[i] = l[i] & r[i];
+            else
+                for (std::size_t i = 0; i < n; ++i) out[i] = l[i] | r[i];
+            break;
+        }
+        case op_t::not_:
+        {
+            const auto * l = evaluate_node(node.m_left, columns, codes, begin, n, masks);
+            for (std::size_t i = 0; i < n; ++i) out[i] = ~l[i];
+            break;
+        }
+        default:
+            switch (node.m_column)
+            {
+            case column_t::temperature:
+                compare(columns.m_temperature.data() + begin, n, node.m_op, node.m_float, out);
+                break;
+            case column_t::humidity:
+                compare(columns.m_humidity.data() + begin, n, node.m_op, node.m_int, out);
+                break;
+            case column_t::date:
+            {
+                const auto * col = columns.m_date.data() + begin;
+                compare(col, n, node.m_op, node.m_int, out);
+
+                // Dates that aren't numbers match no comparison
+                for (std::size_t i = 0; i < n; ++i)
+                    if (col[i] == INT32_MIN) out[i] = 0;
+                break;
+            }
+            case column_t::placeName:
+                compare(columns.m_placeName.data() + begin, n, node.m_op, codes[index], out);
+                break;
+            default:
+                compare(columns.m_id.data() + begin, n, node.m_op, codes[index], out);
+                break;
+            }
+        }
+
+        return out;
+    }
+
+    // Compares n values with value, writing 0xFF or 0 per row
+    template <typename T>
+    static void compare(const T *col, std::size_t n, op_t op, T value, std::uint8_t *out)
+    {
+        std::size_t i = 0;
+#if defined(__SSE2__)
+        i = compare_sse2(col, n, op, value, out);
+#endif
+        for (; i < n; ++i)
+        {
+            bool match;
+            switch (op)
+            {
+            case op_t::eq: match = col[i] == value; break;
+            case op_t::ne: match = col[i] != value; break;
+            case op_t::lt: match = col[i] < value; break;
+            case op_t::le: match = col[i] <= value; break;
+            case op_t::gt: match = col[i] > value; break;
+            default: match = col[i] >= value; break;
+            }
+            out[i] = match ? 0xFF : 0;
+        }
+    }
+
+#if defined(__SSE2__)
+    // Compares 16 rows per iteration, returns the number of rows done
+    static std::size_t compare_sse2(const float *col, std::size_t n, op_t op, float value, std::uint8_t *out)
+    {
+        const __m128 v = _mm_set1_ps(value);
+        const auto cmp = [op, v](const float *p) {
+            const __m128 x = _mm_loadu_ps(p);
+            switch (op)
+            {
+            case op_t::eq: return _mm_castps_si128(_mm_cmpeq_ps(x, v));
+            case op_t::ne: return _mm_castps_si128(_mm_cmpneq_ps(x, v));
+            case op_t::lt: return _mm_castps_si128(_mm_cmplt_ps(x, v));
+            case op_t::le: return _mm_castps_si128(_mm_cmple_ps(x, v));
+            case op_t::gt: return _mm_castps_si128(_mm_cmpgt_ps(x, v));
+            default: return _mm_castps_si128(_mm_cmpge_ps(x, v));
+            }
+        };
+
+        return pack_sse2(col, n, out, cmp);
+    }
+
+    static std::size_t compare_sse2(const std::int32_t *col, std::size_t n, op_t op, std::int32_t value, std::uint8_t *out)
+    {
+        const __m128i v = _mm_set1_epi32(value);
+        const __m128i ones = _mm_set1_epi32(-1);
+        const auto cmp = [op, v, ones](const std::int32_t *p) {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            switch (op)
+            {
+            case op_t::eq: return _mm_cmpeq_epi32(x, v);
+            case op_t::ne: return _mm_xor_si128(_mm_cmpeq_epi32(x, v), ones);
+            case op_t::lt: return _mm_cmplt_epi32(x, v);
+            case op_t::le: return _mm_xor_si128(_mm_cmpgt_epi32(x, v), ones);
+            case op_t::gt: return _mm_cmpgt_epi32(x, v);
+            default: return _mm_xor_si128(_mm_cmplt_epi32(x, v), ones);
+            }
+        };
+
+        return pack_sse2(col, n, out, cmp);
+    }
+
+    // Narrows four 32-bit compare results to 16 mask bytes
+    template <typename T, typename CMP>
+    static std::size_t pack_sse2(const T *col, std::size_t n, std::uint8_t *out, CMP cmp)
+    {
+        std::size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m128i lo = _mm_packs_epi32(cmp(col + i), cmp(col + i + 4));
+            const __m128i hi = _mm_packs_epi32(cmp(col + i + 8), cmp(col + i + 12));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi16(lo, hi));
+        }
+
+        return i;
+    }
+#endif
+
+    // Recursive descent parser for the expressions
+    class parser_t
+    {
+    public:
+        explicit parser_t(const std::string &text) : m_text{text} {}
+
+        // or-expression := and-expression ( "or" and-expression )*
+        std::size_t parse_or(query_plan_t &plan)
+        {
+            auto left = parse_and(plan);
+            while (accept_keyword("or"))
+            {
+                node_t node{op_t::or_};
+                node.m_left = left;
+                node.m_right = parse_and(plan);
+                left = add(plan, std::move(node));
+            }
+            return left;
+        }
+
+        void expect_end()
+        {
+            skip_space();
+            if (m_pos != m_text.size())
+                fail("unexpected text");
+        }
+
+    private:
+        const std::string &m_text;
+        std::size_t m_pos{0};
+
+        // Guards against expressions nested deep enough to overflow the stack
+        std::size_t m_depth{0};
+        static constexpr std::size_t max_depth = 64;
+
+        // Guards against long and/or chains, which evaluate_node() also recurses through, and bounds the masks
+        static constexpr std::size_t max_nodes = 256;
+
+        [[noreturn]] void fail(const std::string &what) const
+        {
+            throw std::invalid_argument(what + " at position " + std::to_string(m_pos));
+        }
+
+        std::size_t add(query_plan_t &plan, node_t node)
+        {
+            if (plan.m_nodes.size() >= max_nodes)
+                fail("expression too long");
+            return plan.add(std::move(node));
+        }
+
+        // and-expression := unary ( "and" unary )*
+        std::size_t parse_and(query_plan_t &plan)
+        {
+            auto left = parse_unary(plan);
+            while (accept_keyword("and"))
+            {
+                node_t node{op_t::and_};
+                node.m_left = left;
+                node.m_right = parse_unary(plan);
+                left = add(plan, std::move(node));
+            }
+            return left;
+        }
+
+        // unary := "not" unary | "(" or-expression ")" | comparison
+        std::size_t parse_unary(query_plan_t &plan)
+        {
+            if (++m_depth > max_depth)
+                fail("expression nested too deep");
+
+            std::size_t result;
+            if (accept_keyword("not"))
+            {
+                node_t node{op_t::not_};
+                node.m_left = parse_unary(plan);
+                result = add(plan, std::move(node));
+            }
+            else if (accept("("))
+            {
+                result = parse_or(plan);
+                if (!accept(")"))
+                    fail("expected )");
+            }
+            else
+            {
+                result = parse_comparison(plan);
+            }
+
+            --m_depth;
+            return result;
+        }
+
+        // comparison := field op literal
+        std::size_t parse_comparison(query_plan_t &plan)
+        {
+            const auto field = read_word();
+            node_t node{op_t::eq};
+
+            if (field == "Temperature") node.m_column = column_t::temperature;
+            else if (field == "Humidity") node.m_column = column_t::humidity;
+            else if (field == "Date") node.m_column = column_t::date;
+            else if (field == "PlaceName") node.m_column = column_t::placeName;
+            else if (field == "ID") node.m_column = column_t::id;
+            else fail("unknown field '" + field + "'");
+
+            // Two-character operators are tried first
+            if (accept("==") || accept("=")) node.m_op = op_t::eq;
+            else if (accept("!=")) node.m_op = op_t::ne;
+            else if (accept("<=")) node.m_op = op_t::le;
+            else if (accept(">=")) node.m_op = op_t::ge;
+            else if (accept("<")) node.m_op = op_t::lt;
+            else if (accept(">")) node.m_op = op_t::gt;
+            else fail("expected operator");
+
+            if (node.m_column == column_t::placeName || node.m_column == column_t::id)
+            {
+                if (node.m_op != op_t::eq && node.m_op != op_t::ne)
+                    fail("only = and != work on " + field);
+                node.m_string = read_string();
+            }
+            else if (node.m_column == column_t::temperature)
+            {
+                if (!parse_whole(read_number(), node.m_float))
+                    fail("invalid number");
+            }
+            else
+            {
+                if (!parse_whole(read_number(), node.m_int))
+                    fail(field + " must be an integer in range");
+            }
+
+            return add(plan, std::move(node));
+        }
+
+        void skip_space()
+        {
+            while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos])))
+                ++m_pos;
+        }
+
+        bool accept(const char *token)
+        {
+            skip_space();
+            const auto len = std::strlen(token);
+            if (0 != m_text.compare(m_pos, len, token))
+                return false;
+
+            m_pos += len;
+            return true;
+        }
+
+        // Keywords are case-insensitive and must end at a word boundary
+        bool accept_keyword(const char *keyword)
+        {
+            skip_space();
+            const auto len = std::strlen(keyword);
+            if (m_pos + len > m_text.size())
+                return false;
+            for (std::size_t i = 0; i < len; ++i)
+                if (std::tolower(static_cast<unsigned char>(m_text[m_pos + i])) != keyword[i])
+                    return false;
+            if (m_pos + len < m_text.size() && std::isalnum(static_cast<unsigned char>(m_text[m_pos + len])))
+                return false;
+
+            m_pos += len;
+            return true;
+        }
+
+        std::string read_word()
+        {
+            skip_space();
+            const auto begin = m_pos;
+            while (m_pos < m_text.size() && std::isalnum(static_cast<unsigned char>(m_text[m_pos])))
+                ++m_pos;
+            if (begin == m_pos)
+                fail("expected field");
+
+            return m_text.substr(begin, m_pos - begin);
+        }
+
+        std::string read_number()
+        {
+            skip_space();
+            const auto begin = m_pos;
+            if (m_pos < m_text.size() && m_text[m_pos] == '-')
+                ++m_pos;
+            while (m_pos < m_text.size() &&
+                (std::isdigit(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '.'))
+                ++m_pos;
+            if (begin == m_pos || (m_pos - begin == 1 && m_text[begin] == '-'))
+                fail("expected number");
+
+            return m_text.substr(begin, m_pos - begin);
+        }
+
+        // Parses the whole of number into value, false if it isn't valid or doesn't fit
+        template <typename T>
+        static bool parse_whole(const std::string &number, T &value)
+        {
+            const auto * end = number.data() + number.size();
+            const auto result = std::from_chars(number.data(), end, value);
+            return result.ec == std::errc{} && result.ptr == end;
+        }
+
+        std::string read_string()
+        {
+            if (!accept("\""))
+                fail("expected string");
+            const auto end = m_text.find('"', m_pos);
+            if (end == std::string::npos)
+                fail("unterminated string");
+
+            auto result = m_text.substr(m_pos, end - m_pos);
+            m_pos = end + 1;
+            return result;
+        }
+    };
+};
+
+// Least recently used cache of compiled query plans, keyed by the expression text
+class query_plan_cache_t
+{
+public:
+    explicit query_plan_cache_t(std::size_t capacity)
+        : m_capacity{capacity}
+    {}
+
+    // Returns the compiled plan for expression, compiling it if it isn't cached
+    std::shared_ptr<const query_plan_t> get(const std::string &expression)
+    {
+        auto it = m_index.find(expression);
+        if (it != m_index.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return it->second->second;
+        }
+
+        auto plan = query_plan_t::compile(expression);
+        m_lru.emplace_front(expression, plan);
+        m_index.emplace(expression, m_lru.begin());
+
+        if (m_lru.size() > m_capacity)
+        {
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+
+        return plan;
+    }
+
+private:
+    std::size_t m_capacity;
+    std::list<std::pair<std::string, std::shared_ptr<const query_plan_t>>> m_lru;
+    std::unordered_map<std::string, decltype(m_lru)::iterator> m_index;
+};
+
+// Mergeable t-digest quantile sketch. Values are summarised in at most a few hundred centroids,
+// small near the tails (so p95 and p99 stay accurate) and larger around the median.
+class tdigest_t
+{
+public:
+    // Adds one value
+    void add(double value)
+    {
+        m_buffer.push_back(centroid_t{value, 1});
+        if (m_buffer.size() >= buffer_size)
+            compress();
+    }
+
+    // Adds all values summarised by other
+    void merge(const tdigest_t &other)
+    {
+        m_buffer.insert(m_buffer.end(), other.m_centroids.begin(), other.m_centroids.end());
+        m_buffer.insert(m_buffer.end(), other.m_buffer.begin(), other.m_buffer.end());
+        if (m_buffer.size() >= buffer_size)
+            compress();
+    }
+
+    // Number of values added
+    double count() const
+    {
+        double total = 0;
+        for (const auto & c : m_centroids) total += c.m_weight;
+        for (const auto & c : m_buffer) total += c.m_weight;
+        return total;
+    }
+
+    // Estimated value at quantile q (0..1), NaN if nothing has been added
+    double quantile(double q)
+    {
+        compress();
+        if (m_centroids.empty())
+            return std::nan("");
+        if (m_centroids.size() == 1)
+            return m_centroids.front().m_mean;
+
+        double total = 0;
+        for (const auto & c : m_centroids) total += c.m_weight;
+
+        // Each centroid's mean is placed at the middle of its weight, values in between are interpolated
+        const double target = q * total;
+        double cumulative = m_centroids.front().m_weight / 2;
+        if (target <= cumulative)
+            return m_min;
+
+        for (std::size_t i = 0; i + 1 < m_centroids.size(); ++i)
+        {
+            const auto & a = m_centroids[i];
+            const auto & b = m_centroids[i + 1];
+            const double step = (a.m_weight + b.m_weight) / 2;
+            if (target <= cumulative + step)
+                return a.m_mean + (b.m_mean - a.m_mean) * (target - cumulative) / step;
+            cumulative += step;
+        }
+
+        return m_max;
+    }
+
+private:
+    // Controls the number of centroids, and with that size versus accuracy
+    static constexpr double compression = 100;
+    static constexpr std::size_t buffer_size = 500;
+
+    struct centroid_t
+    {
+        double m_mean;
+        double m_weight;
+    };
+
+    std::vector<centroid_t> m_centroids;
+    std::vector<centroid_t> m_buffer;
+    double m_min{std::numeric_limits<double>::infinity()};
+    double m_max{-std::numeric_limits<double>::infinity()};
+
+    // Scale function: centroids may span one unit of k
+    static constexpr double pi = 3.14159265358979323846;
+    static double k(double q) { return compression / (2 * pi) * std::asin(2 * q - 1); }
+    static double k_inverse(double k) { return (std::sin(k * 2 * pi / compression) + 1) / 2; }
+
+    // Merges the buffer into the centroids
+    void compress()
+    {
+        if (m_buffer.empty())
+            return;
+
+        m_buffer.insert(m_buffer.end(), m_centroids.begin(), m_centroids.end());
+        std::sort(m_buffer.begin(), m_buffer.end(),
+            [](const centroid_t &a, const centroid_t &b) { return a.m_mean < b.m_mean; });
+
+        m_min = std::min(m_min, m_buffer.front().m_mean);
+        m_max = std::max(m_max, m_buffer.back().m_mean);
+
+        double total = 0;
+        for (const auto & c : m_buffer) total += c.m_weight;
+
+        m_centroids.clear();
+        auto current = m_buffer.front();
+        double before = 0;
+        double limit = total * k_inverse(k(0) + 1);
+
+        for (std::size_t i = 1; i < m_buffer.size(); ++i)
+        {
+            const auto & next = m_buffer[i];
+            if (before + current.m_weight + next.m_weight <= limit)
+            {
+                current.m_weight += next.m_weight;
+                current.m_mean += (next.m_mean - current.m_mean) * next.m_weight / current.m_weight;
+            }
+            else
+            {
+                before += current.m_weight;
+                // k peaks at compression / 4 (q = 1), past it k_inverse wraps around and the limit would shrink
+                limit = total * k_inverse(std::min(k(before / total) + 1, compression / 4));
+                m_centroids.push_back(current);
+                current = next;
+            }
+        }
+        m_centroids.push_back(current);
+        m_buffer.clear();
+    }
+};
+
+// Temperature and humidity sketches for a set of readings
+struct sketch_pair_t
+{
+    tdigest_t m_temperature;
+    tdigest_t m_humidity;
+
+    void add(const weatherStation_t &reading)
+    {
+        m_temperature.add(reading.m_Temperature);
+        m_humidity.add(reading.m_Humidity);
+    }
+
+    void merge(const sketch_pair_t &other)
+    {
+        m_temperature.merge(other.m_temperature);
+        m_humidity.merge(other.m_humidity);
+    }
+};
+
+// Quantile sketches per station, in total and per day (m_Date). Readings can't be taken out of a sketch,
+// so a reading that is updated or deleted marks its station and day dirty, and those sketches are rebuilt
+// from the collection the next time they are asked for.
+class station_percentiles_t
+{
+public:
+    void add(const weatherStation_t &reading)
+    {
+        auto & station = m_stations[reading.m_ID];
+        station.m_total.add(reading);
+
+        const auto date = weatherStation_columns_t::to_date(reading.m_Date);
+        if (date == INT32_MIN)
+            return;
+
+        station.m_days[date].add(reading);
+        trim(station);
+    }
+
+    // Marks the sketches holding a reading that is about to be updated or deleted
+    void mark_dirty(const weatherStation_t &reading)
+    {
+        auto it = m_stations.find(reading.m_ID);
+        if (it == m_stations.end())
+            return;
+
+        it->second.m_totalDirty = true;
+        const auto date = weatherStation_columns_t::to_date(reading.m_Date);
+        if (date != INT32_MIN)
+            it->second.m_dirtyDays.insert(date);
+    }
+
+    // Sketches of a station for the days from..to (YYYYMMDD), or in total if no range is given.
+    // Returns nothing for an unknown station.
+    std::optional<sketch_pair_t> get(
+        const std::string &id, std::optional<std::int32_t> from, std::optional<std::int32_t> to,
+        const weatherStation_rows_t &weatherStation)
+    {
+        auto it = m_stations.find(id);
+        if (it == m_stations.end())
+            return std::nullopt;
+
+        if (it->second.m_totalDirty)
+        {
+            rebuild(id, it->second, weatherStation);
+
+            // All of its readings were deleted or moved to other stations
+            if (0 == it->second.m_total.m_temperature.count())
+            {
+                m_stations.erase(it);
+                return std::nullopt;
+            }
+        }
+
+        if (!from && !to)
+            return it->second.m_total;
+
+        // Merges the day sketches in the range, at most max_days of them
+        sketch_pair_t result;
+        const auto & days = it->second.m_days;
+        for (auto day = days.lower_bound(from.value_or(INT32_MIN));
+            day != days.end() && day->first <= to.value_or(INT32_MAX); ++day)
+            result.merge(day->second);
+
+        return result;
+    }
+
+private:
+    // Days kept per station
+    static constexpr std::size_t max_days = 400;
+
+    struct station_t
+    {
+        sketch_pair_t m_total;
+        std::map<std::int32_t, sketch_pair_t> m_days;
+
+        // Set by mark_dirty(), cleared by rebuild()
+        bool m_totalDirty{false};
+        std::set<std::int32_t> m_dirtyDays;
+    };
+
+    std::unordered_map<std::string, station_t> m_stations;
+
+    // Keeps memory per station bounded by dropping the oldest day
+    static void trim(station_t &station)
+    {
+        while (station.m_days.size() > max_days)
+            station.m_days.erase(station.m_days.begin());
+    }
+
+    // Rebuilds the total and the dirty days of a station from the collection
+    static void rebuild(const std::string &id, station_t &station, const weatherStation_rows_t &weatherStation)
+    {
+        station.m_total = sketch_pair_t{};
+        for (const auto date : station.m_dirtyDays)
+            station.m_days.erase(date);
+
+        for (const auto & row : weatherStation)
+        {
+            const auto & b = *row;
+            if (b.m_ID != id)
+                continue;
+
+            station.m_total.add(b);
+            const auto date = weatherStation_columns_t::to_date(b.m_Date);
+            if (station.m_dirtyDays.count(date))
+                station.m_days[date].add(b);
+        }
+
+        trim(station);
+        station.m_totalDirty = false;
+        station.m_dirtyDays.clear();
+    }
+};
+
+// Implementation of struct percentiles_t, the respons for '/percentiles/:ID'
+struct percentiles_t
+{
+    // p50, p95 and p99 of one field
+    struct values_t
+    {
+        template <typename JSON_IO>
+        void
+        json_io(JSON_IO &io)
+        {
+            io
+                & json_dto::mandatory("p50", m_p50)
+                & json_dto::mandatory("p95", m_p95)
+                & json_dto::mandatory("p99", m_p99);
+        }
+
+        double m_p50;
+        double m_p95;
+        double m_p99;
+    };
+
+    // Reads the percentiles from a sketch
+    static values_t of(tdigest_t &sketch)
+    {
+        return values_t{sketch.quantile(0.5), sketch.quantile(0.95), sketch.quantile(0.99)};
+    }
+
+    // JSON I/O funktion to work with json_dto
+    template <typename JSON_IO>
+    void
+    json_io(JSON_IO &io)
+    {
+        io
+            & json_dto::mandatory("ID", m_ID)
+            & json_dto::mandatory("Count", m_Count)
+            & json_dto::mandatory("Temperature", m_Temperature)
+            & json_dto::mandatory("Humidity in %", m_Humidity);
+    }
+
+    // Members of struct percentiles_t
+    std::string m_ID;
+    std::uint64_t m_Count;
+    values_t m_Temperature;
+    values_t m_Humidity;
+};
+
+// Writes a CSV field, quoted if it contains a separator, quote or line break
+inline void write_csv_field(std::ostream &out, const std::string &value)
+{
+    if (value.find_first_of(",\"\r\n") == std::string::npos)
+    {
+        out << value;
+        return;
+    }
+
+    out << '"';
+    for (const char c : value)
+    {
+        if (c == '"')
+            out << '"';
+        out << c;
+    }
+    out << '"';
+}
+
+// Writes the records as CSV with a header line
+inline void export_csv(std::ostream &out, const weatherStation_rows_t &rows)
+{
+    out << "ID,Date,Time,PlaceName,Lat,Lon,Temperature,Humidity in %\n";
+    for (const auto & row : rows)
+    {
+        const auto & b = *row;
+        for (const auto * field : {&b.m_ID, &b.m_Date, &b.m_Time, &b.m_PlaceName, &b.m_Lat, &b.m_Lon})
+        {
+            write_csv_field(out, *field);
+            out << ',';
+        }
+        out << b.m_Temperature << ',' << b.m_Humidity << '\n';
+    }
+}
+
+// Writes the records in a columnar binary format, native byte order:
+//   "WSCOL1\0\0", uint64 row count,
+//   float32 Temperature[rows], int32 Humidity[rows], int32 Date as YYYYMMDD[rows],
+//   then ID, Date, Time, PlaceName, Lat, Lon, each as rows times (uint32 length, bytes).
+inline void export_columnar(std::ostream &out, const weatherStation_rows_t &rows)
+{
+    const auto write = [&out](const auto &value) {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+
+    out.write("WSCOL1\0\0", 8);
+    write(static_cast<std::uint64_t>(rows.size()));
+
+    for (const auto & b : rows) write(b->m_Temperature);
+    for (const auto & b : rows) write(static_cast<std::int32_t>(b->m_Humidity));
+    for (const auto & b : rows) write(weatherStation_columns_t::to_date(b->m_Date));
+
+    for (const auto field : {&weatherStation_t::m_ID, &weatherStation_t::m_Date, &weatherStation_t::m_Time,
+        &weatherStation_t::m_PlaceName, &weatherStation_t::m_Lat, &weatherStation_t::m_Lon})
+    {
+        for (const auto & b : rows)
+        {
+            const auto & value = (*b).*field;
+            write(static_cast<std::uint32_t>(value.size()));
+            out.write(value.data(), static_cast<std::streamsize>(value.size()));
+        }
+    }
+}
+
+// Kind of request, each with its own rate limits
+enum class admission_class_t { read, write, upgrade };
+
+// Token-bucket rate limits per client IP and for the whole server. Requests are rejected before
+// any work is done on them, so a client posting in a tight loop can't starve everybody else.
+class admission_control_t
+{
+public:
+    // Sustained requests per second and the burst allowed above it
+    struct limit_t
+    {
+        double m_rate;
+        double m_burst;
+    };
+
+    // One limit per admission_class_t
+    using limits_t = std::array<limit_t, 3>;
+
+    enum class verdict_t { admitted, client_limited, overloaded };
+
+    struct decision_t
+    {
+        verdict_t m_verdict;
+        // Seconds until a request of the same kind would be admitted
+        std::uint32_t m_retryAfter;
+    };
+
+    admission_control_t(limits_t per_client, limits_t global)
+        : m_perClient{per_client},
+          m_global{global}
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < m_globalBuckets.size(); ++i)
+            m_globalBuckets[i] = bucket_t{m_global[i].m_burst, now};
+    }
+
+    // Takes a token from the client's bucket and then from the global bucket
+    decision_t admit(const std::string &client, admission_class_t kind, std::chrono::steady_clock::time_point now)
+    {
+        const auto k = static_cast<std::size_t>(kind);
+
+        auto it = m_clients.find(client);
+        if (it == m_clients.end())
+        {
+            client_t c;
+            for (std::size_t i = 0; i < c.m_buckets.size(); ++i)
+                c.m_buckets[i] = bucket_t{m_perClient[i].m_burst, now};
+            it = m_clients.emplace(client, c).first;
+        }
+        it->second.m_lastSeen = now;
+
+        // The client's own limit is checked first, so a throttled client doesn't use up the global tokens
+        if (const auto wait = it->second.m_buckets[k].take(m_perClient[k], now); wait > 0)
+        {
+            ++m_clientLimited;
+            return {verdict_t::client_limited, retry_after(wait)};
+        }
+        if (const auto wait = m_globalBuckets[k].take(m_global[k], now); wait > 0)
+        {
+            // Gives the client its token back, as the request isn't handled
+            it->second.m_buckets[k].m_tokens += 1;
+            ++m_overloaded;
+            return {verdict_t::overloaded, retry_after(wait)};
+        }
+
+        return {verdict_t::admitted, 0};
+    }
+
+    // Rejects a request shed for another reason than the buckets, counted with the 503s
+    decision_t shed(std::uint32_t retry_after_seconds)
+    {
+        ++m_overloaded;
+        return {verdict_t::overloaded, retry_after_seconds};
+    }
+
+    // Forgets clients not seen for idle, bounding the memory used for buckets
+    void evict_idle(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration idle)
+    {
+        for (auto it = m_clients.begin(); it != m_clients.end(); )
+        {
+            if (now - it->second.m_lastSeen > idle)
+                it = m_clients.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // Number of requests rejected with 429 and 503
+    std::uint64_t client_limited() const { return m_clientLimited; }
+    std::uint64_t overloaded() const { return m_overloaded; }
+
+private:
+    struct bucket_t
+    {
+        double m_tokens{0};
+        std::chrono::steady_clock::time_point m_last;
+
+        // Refills the bucket and takes a token, returns 0 or the seconds until a token is available
+        double take(const limit_t &limit, std::chrono::steady_clock::time_point now)
+        {
+            const std::chrono::duration<double> elapsed = now - m_last;
+            m_tokens = std::min(limit.m_burst, m_tokens + elapsed.count() * limit.m_rate);
+            m_last = now;
+
+            if (m_tokens >= 1)
+            {
+                m_tokens -= 1;
+                return 0;
+            }
+
+            return (1 - m_tokens) / limit.m_rate;
+        }
+    };
+
+    struct client_t
+    {
+        std::array<bucket_t, 3> m_buckets;
+        std::chrono::steady_clock::time_point m_lastSeen;
+    };
+
+    static std::uint32_t retry_after(double seconds)
+    {
+        return static_cast<std::uint32_t>(std::ceil(seconds));
+    }
+
+    limits_t m_perClient;
+    limits_t m_global;
+    std::array<bucket_t, 3> m_globalBuckets;
+    std::unordered_map<std::string, client_t> m_clients;
+
+    std::uint64_t m_clientLimited{0};
+    std::uint64_t m_overloaded{0};
+};
+
+// Class to handle weatherStation
+class weatherStation_handler_t
+{
+public:
+    weatherStation_handler_t(const weatherStation_collection_t &weatherStation, restinio::asio_ns::io_context &ioctx)
+        : m_weatherStation(to_rows(weatherStation)),
+          m_changeLog(change_log_capacity),
+          m_versions(tombstone_capacity),
+          m_plans(query_plan_cache_capacity),
+          m_heartbeatTimer(ioctx),
+          m_admission(
+              {admission_control_t::limit_t{50, 100}, {10, 20}, {1, 5}},
+              {admission_control_t::limit_t{2000, 4000}, {500, 1000}, {50, 100}})
+    {
+		// Initial records are stamped with version 0
+		for (const auto & row : m_weatherStation)
+		{
+			const auto & b = *row;
+			m_versions.on_insert(0);
+			m_columns.push_back(b);
+			m_percentiles.add(b);
+		}
+
+		remove_old_exports();
+		schedule_heartbeat();
+	}
+	
+	weatherStation_handler_t( const weatherStation_handler_t & ) = delete;
+	weatherStation_handler_t( weatherStation_handler_t && ) = delete;
+
+	// Lock held while handling a request or WebSocket-message, as several acceptor threads share the handler
+	std::mutex & mutex() { return m_lock; }
+
+    // Admission control for every request, called before its handler.
+	// Returns false if the request is rejected, in which case it has been answered with 429 or 503 and Retry-After.
+	bool admit(const restinio::request_handle_t &req)
+	{
+		auto kind = admission_class_t::write;
+		if (restinio::http_connection_header_t::upgrade == req->header().connection())
+			kind = admission_class_t::upgrade;
+		else if (restinio::http_method_get() == req->header().method() ||
+			restinio::http_method_head() == req->header().method() ||
+			restinio::http_method_options() == req->header().method())
+			kind = admission_class_t::read;
+
+		// WebSocket-connections are also capped in total, checked first so a refused upgrade doesn't use up tokens
+		const auto decision = kind == admission_class_t::upgrade && m_registry.size() >= max_ws_connections ?
+			m_admission.shed(static_cast<std::uint32_t>(heartbeat_interval.count())) :
+			m_admission.admit(req->remote_endpoint().address().to_string(), kind, std::chrono::steady_clock::now());
+
+		if (decision.m_verdict == admission_control_t::verdict_t::admitted)
+			return true;
+
+		const bool overloaded = decision.m_verdict == admission_control_t::verdict_t::overloaded;
+		auto resp = init_resp(req->create_response(overloaded ?
+			restinio::status_service_unavailable() :
+			restinio::http_status_line_t{restinio::http_status_code_t{429}, "Too Many Requests"}));
+		resp.append_header(restinio::http_field::retry_after, fmt::format("{}", std::max(decision.m_retryAfter, 1u)));
+
+		// Shedding load also closes the connection, so it frees its slot
+		if (overloaded)
+			resp.connection_close();
+
+		resp.done();
+		return false;
+	}
 
     // Handler-function to handle request for weatherStation data (Opgave 1)
 	auto on_weatherStation_list(
@@ -88,9 +1658,112 @@ public:
 			auto resp = init_resp(req->create_response());
 
 			// JSON-formated respons.
-    		resp.set_body(json_dto::to_json(m_weatherStation));
+    		resp.set_body(to_json(m_weatherStation));
 			return resp.done();
     	}
+	// Handler-function for handling HTTP GET-requests for "/export?format=csv|columnar&from=<Date>&to=<Date>".
+	// The records (in the optional date range) are written to a snapshot file named after the current sequence number,
+	// which is sent with sendfile. Later exports of the same range are served from the file until the data changes.
+	// Only pointers to the rows are copied here, the records are shared with the export thread, which writes the file
+	// and sends the response.
+	auto on_weatherStation_export(const restinio::request_handle_t &req, rr::route_params_t params)
+	{
+		try
+		{
+			const auto qp = restinio::parse_query(req->header().query());
+			const auto format = restinio::value_or(qp, "format", std::string{"csv"});
+			if (format != "csv" && format != "columnar")
+				throw std::invalid_argument("unknown format");
+
+			const auto from = restinio::value_or<std::int32_t>(qp, "from", INT32_MIN);
+			const auto to = restinio::value_or<std::int32_t>(qp, "to", INT32_MAX);
+			const bool csv = format == "csv";
+
+			const auto seq = m_changeLog.last_seq();
+			const auto file = export_dir / fmt::format("weather-{}-{}-{}-{}.{}",
+				m_run, seq, from, to, csv ? "csv" : "col");
+
+			// Served from the snapshot, if this range has been exported since the data last changed
+			const auto cached = std::find_if(m_exportFiles.begin(), m_exportFiles.end(),
+				[&](const auto &e) { return e.second == file; });
+			if (cached != m_exportFiles.end() && std::filesystem::exists(file))
+			{
+				m_exportFiles.splice(m_exportFiles.begin(), m_exportFiles, cached);
+				return export_response(req, file, csv).done();
+			}
+
+			// Rows in the date range, from the numeric date column
+			weatherStation_rows_t rows;
+			for (std::size_t i = 0; i < m_columns.size(); ++i)
+				if (from <= m_columns.m_date[i] && m_columns.m_date[i] <= to)
+					rows.push_back(m_weatherStation[i]);
+
+			restinio::asio_ns::post(m_exportPool, [this, req, file, csv, seq, rows = std::move(rows)] {
+				try
+				{
+					write_export(file, csv, rows);
+
+					// sendfile opens the file here, so it can still be sent if the snapshot is removed
+					auto resp = export_response(req, file, csv);
+					{
+						std::lock_guard<std::mutex> lock{m_lock};
+						remember_export(file, seq);
+					}
+					resp.done();
+				}
+				catch (const std::exception &)
+				{
+					init_resp(req->create_response(restinio::status_internal_server_error())).done();
+				}
+			});
+
+			return restinio::request_accepted();
+		}
+		catch (const std::exception &)
+		{
+			auto resp = init_resp(req->create_response());
+			mark_as_bad_request(resp);
+			return resp.done();
+		}
+	}
+
+	// Handler-function for handling HTTP GET-requests for "/percentiles/:ID?from=<Date>&to=<Date>".
+	// Returns p50, p95 and p99 of temperature and humidity for a station, in total or for the days in the range.
+	auto on_weatherStation_percentiles(const restinio::request_handle_t &req, rr::route_params_t params)
+	{
+		auto resp = init_resp(req->create_response());
+		try
+		{
+			const auto ID = restinio::utils::unescape_percent_encoding(params["ID"]);
+			const auto qp = restinio::parse_query(req->header().query());
+			const auto from = restinio::opt_value<std::int32_t>(qp, "from");
+			const auto to = restinio::opt_value<std::int32_t>(qp, "to");
+
+			auto sketches = m_percentiles.get(ID,
+				from ? std::optional<std::int32_t>{*from} : std::nullopt,
+				to ? std::optional<std::int32_t>{*to} : std::nullopt,
+				m_weatherStation);
+
+			// Unknown station, or no readings in the range
+			if (!sketches || 0 == sketches->m_temperature.count())
+			{
+				resp.header().status_line(restinio::status_not_found());
+				return resp.done();
+			}
+
+			resp.set_body(json_dto::to_json(percentiles_t{
+				ID,
+				static_cast<std::uint64_t>(sketches->m_temperature.count()),
+				percentiles_t::of(sketches->m_temperature),
+				percentiles_t::of(sketches->m_humidity)}));
+		}
+		catch (const std::exception &)
+		{
+			mark_as_bad_request(resp);
+		}
+		return resp.done();
+	}
+
 	// Handler-function to handle HTTP POST-requests for adding new weather data (Opgave 2.1)
     auto on_weatherStation_addNew(const restinio::request_handle_t &req, rr::route_params_t)
     {
@@ -99,10 +1772,18 @@ public:
 		try
 		{
 		  // Analyzes JSON-data from requests and adds onto stack
-		  m_weatherStation.emplace_back(json_dto::from_json<weatherStation_t>(req->body()));
+		  m_weatherStation.push_back(
+			  std::make_shared<const weatherStation_t>(json_dto::from_json<weatherStation_t>(req->body())));
+		  const auto & b = *m_weatherStation.back();
 
-		  // Sends message to WebSocket-clients, added for Delopgave3
-		  sendMessage("POST: id =" + json_dto::from_json<weatherStation_t>(req->body()).m_ID);
+		  // Logs the change and sends it to WebSocket-clients, added for Delopgave3
+		  const auto seq = record_change("POST", m_weatherStation.size(), b);
+		  m_versions.on_insert(seq);
+		  m_columns.push_back(b);
+
+		  // Evaluates standing queries for the new reading
+		  evaluate_alerts(b);
+		  m_percentiles.add(b);
 		}
 		catch (const std::exception &)
 		{
@@ -126,8 +1807,8 @@ public:
 			// Iterates through the last three weather data.
 			for (auto iter = m_weatherStation.rbegin(); iter != m_weatherStation.rend() && (i !=3); ++iter, ++i) 
 			{
-			  weatherStation_three.push_back(*iter);
-			  std::cout << i << " - " << iter-> m_ID << std::endl;
+			  weatherStation_three.push_back(**iter);
+			  std::cout << i << " - " << (*iter)-> m_ID << std::endl;
 			}
 			resp.set_body(json_dto::to_json(weatherStation_three));
 		}
@@ -153,7 +1834,7 @@ public:
 			// Filters data based on date
 			for( std::size_t i=0; i < m_weatherStation.size(); ++i)
 			{
-				const auto & b = m_weatherStation[i];
+				const auto & b = *m_weatherStation[i];
 				if ( Date == b.m_Date )
 				{
 					weatherStation_date.push_back(b);
@@ -168,6 +1849,29 @@ public:
 		return resp.done();
 	}
 
+	// Handler-function for handling HTTP GET-requests for "/query?q=<expression>". Returns data matching the expression,
+	// e.g. Temperature > 20 and PlaceName = "Aarhus N" and Date >= 20231201
+	auto on_weatherStation_query(const restinio::request_handle_t &req, rr::route_params_t params)
+	{
+		auto resp = init_resp(req->create_response());
+		try
+		{
+			const auto qp = restinio::parse_query(req->header().query());
+			const auto plan = m_plans.get(restinio::cast_to<std::string>(qp["q"]));
+
+			std::vector<weatherStation_t> weatherStation_query;
+			for (const auto i : plan->evaluate(m_columns))
+				weatherStation_query.push_back(*m_weatherStation[i]);
+
+			resp.set_body(json_dto::to_json(weatherStation_query));
+		}
+		catch (const std::exception &)
+		{
+			mark_as_bad_request(resp);
+		}
+		return resp.done();
+	}
+
 	// Handler-function for handling HTTP PUT-Requests for updating existing data (Opgave 2.3)
 	auto on_weatherStation_addUpdate(
 		const restinio::request_handle_t& req, rr::route_params_t params )
@@ -183,7 +1887,14 @@ public:
 			
 			if (0 != ID && ID <= m_weatherStation.size())
 			{
-				m_weatherStation[ID - 1] = b;
+				m_percentiles.mark_dirty(*m_weatherStation[ID - 1]);
+				m_weatherStation[ID - 1] = std::make_shared<const weatherStation_t>(b);
+				const auto seq = record_change("PUT", ID, std::move(b));
+				m_versions.on_update(ID - 1, seq);
+				m_columns.assign(ID - 1, *m_weatherStation[ID - 1]);
+				// No evaluate_alerts(): an edited reading is often an old one, and the rate and window
+				// queries only follow new readings from POST
+				m_percentiles.add(*m_weatherStation[ID - 1]);
 			}
 			else
 			{
@@ -198,15 +1909,95 @@ public:
 		return resp.done();
 	}
 
+	// Handler-function for handling HTTP GET-requests for "/changes?since=<Version>".
+	// Returns the records inserted, updated or deleted after Version, and the new Version to poll from.
+	// Versions are tokens ("<Run>-<Seq>"). Without since, if since is too old or from another run of the server,
+	// every record is returned with "Reset" set.
+	auto on_weatherStation_changes(const restinio::request_handle_t &req, rr::route_params_t params)
+	{
+		auto resp = init_resp(req->create_response());
+
+		try
+		{
+			const auto qp = restinio::parse_query(req->header().query());
+
+			std::optional<seq_token_t> since;
+			if (qp.has("since"))
+				since = seq_token_t::parse(restinio::cast_to<std::string>(qp["since"]));
+
+			const bool reset = !since || since->m_run != m_run ||
+				since->m_seq > m_changeLog.last_seq() || !m_versions.covers(since->m_seq);
+
+			std::string changes;
+			auto out = std::back_inserter(changes);
+			const auto add_upsert = [&](std::size_t pos, std::uint64_t version) {
+				fmt::format_to(out, R"({}{{"Key":{},"Version":{},"Op":"upsert","Index":{},"Record":{}}})",
+					changes.empty() ? "" : ",", m_versions.key(pos), version, pos + 1,
+					json_dto::to_json(*m_weatherStation[pos]));
+			};
+			const auto add_delete = [&](std::uint64_t key, std::uint64_t version) {
+				fmt::format_to(out, R"({}{{"Key":{},"Version":{},"Op":"delete"}})",
+					changes.empty() ? "" : ",", key, version);
+			};
+
+			if (reset)
+			{
+				for (std::size_t i = 0; i < m_weatherStation.size(); ++i)
+					add_upsert(i, m_versions.version(i));
+			}
+			else
+			{
+				m_versions.for_each_since(since->m_seq, add_upsert, add_delete);
+			}
+
+			resp.set_body(fmt::format(R"({{"Version":"{}","Reset":{},"Changes":[{}]}})",
+				current_token().to_string(), reset, changes));
+		}
+		catch (const std::exception &)
+		{
+			mark_as_bad_request(resp);
+		}
+
+		return resp.done();
+	}
+
 	// Handler-funktion to handle WebSocket-updates (Opgave 3)
+	// A client gets the current token ("<Run>-<Seq>") when it connects. When reconnecting,
+	// it can connect to '/chat?since=<Token>' to receive the changes it missed.
 	auto on_weatherStation_liveUpdate(const restinio::request_handle_t &req, rr::route_params_t params)
     {
         if (restinio::http_connection_header_t::upgrade==req ->header().connection() )
         {
+			// Gets the last seen token from the query, if any.
+			std::optional<seq_token_t> since;
+			try
+			{
+				const auto qp = restinio::parse_query(req->header().query());
+				if (qp.has("since"))
+					since = seq_token_t::parse(restinio::cast_to<std::string>(qp["since"]));
+			}
+			catch (const std::exception &)
+			{
+				auto resp = init_resp(req->create_response());
+				mark_as_bad_request(resp);
+				return resp.done();
+			}
+
 			// Upgrading connection to WebSocket.
             auto wsh = rws::upgrade<traits_t>(*req, rws::activation_t::immediate, [this] (auto wsh, auto m)
             {
-                if (rws::opcode_t::text_frame==m->opcode()||rws::opcode_t::binary_frame == m->opcode() ||rws::opcode_t::continuation_frame == m->opcode())
+				std::lock_guard<std::mutex> lock{m_lock};
+
+				// Any frame shows the client is alive
+				auto client = m_registry.find(wsh ->connection_id() );
+				if (client != m_registry.end())
+					client->second.m_lastSeen = std::chrono::steady_clock::now();
+
+                if (rws::opcode_t::text_frame==m->opcode() && on_alert_command(wsh, m->payload()))
+                {
+					// "subscribe <QueryID>" and "unsubscribe <QueryID>" are handled by on_alert_command
+                }
+                else if (rws::opcode_t::text_frame==m->opcode()||rws::opcode_t::binary_frame == m->opcode() ||rws::opcode_t::continuation_frame == m->opcode())
                 {
                     wsh ->send_message(*m);
                 }
@@ -217,19 +2008,29 @@ public:
                     resp.set_opcode(rws::opcode_t::pong_frame);
                     wsh ->send_message(resp);
                 }
+                else if (rws::opcode_t::pong_frame==m ->opcode() )
+                {
+					// Answer to our heartbeat ping
+					if (client != m_registry.end())
+						client->second.m_pingSent.reset();
+                }
                 else if (rws::opcode_t::connection_close_frame== m ->opcode() )
                 {
 					// Removing WebSocket-connection from register when shutdown
                     m_registry.erase(wsh ->connection_id() );
+                    m_alerts.remove_connection(wsh ->connection_id() );
                 }
             });
 
 		// Adding WebSocket-handle to register.
-        m_registry.emplace(wsh -> connection_id(), wsh);
+        m_registry.emplace(wsh -> connection_id(), ws_client_t{wsh, std::chrono::steady_clock::now(), std::nullopt});
 
 		// Initializing and sending HTTP-respons without body.
         init_resp(req ->create_response() ).done();
 
+		// Sends the current token, or the missed changes to a reconnecting client.
+		send_resume(wsh, since);
+
 		// Signals accepted request
         return restinio::request_accepted();
         }
@@ -238,6 +2039,57 @@ public:
         return restinio::request_rejected();
     }
 
+	// Handler-function for handling HTTP POST-requests for "/alerts". Registers a standing query and returns it with its QueryID.
+	auto on_alert_add(const restinio::request_handle_t &req, rr::route_params_t)
+	{
+		auto resp = init_resp(req->create_response());
+
+		try
+		{
+			const auto queryID = m_alerts.add(json_dto::from_json<standingQuery_t>(req->body()));
+			resp.set_body(fmt::format(R"({{"QueryID":{}}})", queryID));
+		}
+		catch (const std::exception &)
+		{
+			mark_as_bad_request(resp);
+		}
+
+		return resp.done();
+	}
+
+	// Handler-function for handling HTTP GET-requests for "/alerts". Returns all standing queries.
+	auto on_alert_list(const restinio::request_handle_t &req, rr::route_params_t)
+	{
+		auto resp = init_resp(req->create_response());
+		resp.set_body(json_dto::to_json(m_alerts.queries()));
+		return resp.done();
+	}
+
+	// Handler-function for handling HTTP DELETE-requests for "/alerts/:QID". Removes a standing query.
+	auto on_alert_delete(const restinio::request_handle_t &req, rr::route_params_t params)
+	{
+		auto resp = init_resp(req->create_response());
+		const auto QID = restinio::cast_to<std::uint32_t>(params["QID"]);
+
+		if (!m_alerts.remove(QID))
+			mark_as_bad_request(resp);
+
+		return resp.done();
+	}
+
+	// Handler-function for handling HTTP GET-requests for "/connections". Returns live and reaped WebSocket-connection counts.
+	auto on_connections_stats(const restinio::request_handle_t &req, rr::route_params_t)
+	{
+		auto resp = init_resp(req->create_response());
+
+		const auto awaiting = std::count_if(m_registry.begin(), m_registry.end(),
+			[](const auto &c) { return c.second.m_pingSent.has_value(); });
+
+		resp.set_body(fmt::format(R"({{"Live":{},"AwaitingPong":{},"Reaped":{},"Throttled":{},"Shed":{}}})",
+			m_registry.size(), awaiting, m_reaped, m_admission.client_limited(), m_admission.overloaded()));
+		return resp.done();
+	}
+
 	// Handler-function for handling HTTP OPTIONS-requests.
 	auto weatherStation_options(restinio::request_handle_t req, restinio::router::route_params_t)
 	{
@@ -262,7 +2114,12 @@ public:
 			if (0 != ID && ID <= m_weatherStation.size())
 			{
 				// Deleting data based on ID
+				const auto b = std::move(m_weatherStation[ID - 1]);
 				m_weatherStation.erase(m_weatherStation.begin() + (ID - 1));
+				m_percentiles.mark_dirty(*b);
+				const auto seq = record_change("DELETE", ID, *b);
+				m_versions.on_erase(ID - 1, seq);
+				m_columns.erase(ID - 1);
 			}
 			
 		}
@@ -274,7 +2131,43 @@ public:
     }
     
 private:
-    weatherStation_collection_t &m_weatherStation;
+    weatherStation_rows_t m_weatherStation;
+
+	// Number of changes kept for replay to reconnecting WebSocket-clients
+	static constexpr std::size_t change_log_capacity = 1024;
+
+	// Log of the latest changes, see record_change()
+	change_log_t m_changeLog;
+
+	// Identifies this run of the server in tokens and snapshot file names, as sequence numbers restart from 0
+	const std::uint64_t m_run{static_cast<std::uint64_t>(std::chrono::system_clock::now().time_since_epoch().count())};
+
+	// Token of the latest change
+	seq_token_t current_token() const { return {m_run, m_changeLog.last_seq()}; }
+
+	// Serialized collection, shared by all snapshots sent at the same sequence number
+	std::optional<std::string> m_snapshot;
+
+	// Number of deletions remembered for '/changes'
+	static constexpr std::size_t tombstone_capacity = 4096;
+
+	// Version stamps of the records, using the sequence numbers of the change log
+	record_versions_t m_versions;
+
+	// Standing queries and their subscribed WebSocket-clients
+	alert_engine_t m_alerts;
+
+	// Numeric columns of the records, scanned by '/query'
+	weatherStation_columns_t m_columns;
+
+	// Number of compiled expressions kept for '/query'
+	static constexpr std::size_t query_plan_cache_capacity = 64;
+
+	// Compiled expressions for '/query'
+	query_plan_cache_t m_plans;
+
+	// Quantile sketches per station for '/percentiles/:ID'
+	station_percentiles_t m_percentiles;
 
     // Initializing respons with necessary headers
     template <typename RESP>
@@ -299,26 +2192,272 @@ private:
         resp.header().status_line(restinio::status_bad_request());
     }
 
+	// See mutex()
+	std::mutex m_lock;
+
 	// Registry for WebSocket to store all the subscribed clients
     ws_registry_t   m_registry;
 
+	// How often connections are checked, a client silent for heartbeat_idle is pinged,
+	// and one that hasn't answered within heartbeat_pong_timeout is closed.
+	static constexpr std::chrono::seconds heartbeat_interval{5};
+	static constexpr std::chrono::seconds heartbeat_idle{15};
+	static constexpr std::chrono::seconds heartbeat_pong_timeout{10};
+
+	// Timer for the heartbeats, on the server's io_context
+	restinio::asio_ns::steady_timer m_heartbeatTimer;
+
+	// Number of connections closed for not answering a ping
+	std::uint64_t m_reaped{0};
+
+	// Directory of the snapshot files for '/export'
+	inline static const std::filesystem::path export_dir{"exports"};
+
+	// Time allowed for sending an export
+	static constexpr std::chrono::minutes export_timelimit{10};
+
+	// Number of snapshot files kept, the least recently used is removed first
+	static constexpr std::size_t max_export_files = 8;
+
+	// Snapshot files for '/export' and the sequence number of their data, most recently used first
+	std::list<std::pair<std::uint64_t, std::filesystem::path>> m_exportFiles;
+
+	// Response sending a snapshot file for '/export'
+	static auto export_response(const restinio::request_handle_t &req, const std::filesystem::path &file, bool csv)
+	{
+		auto resp = init_resp(req->create_response());
+		resp.header().set_field(restinio::http_field::content_type, csv ? "text/csv" : "application/octet-stream");
+		resp.append_header(restinio::http_field::content_disposition,
+			fmt::format("attachment; filename=\"{}\"", file.filename().string()));
+		resp.set_body(restinio::sendfile(file.string()).timelimit(export_timelimit));
+		return resp;
+	}
+
+	// Writes a snapshot file for '/export', on the export thread
+	static void write_export(const std::filesystem::path &file, bool csv, const weatherStation_rows_t &rows)
+	{
+		std::filesystem::create_directories(export_dir);
+
+		// Written under a temporary name, so a half-written file is never served.
+		// There is only one export thread, so the name can't clash.
+		auto tmp = file;
+		tmp += ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+			if (csv)
+				export_csv(out, rows);
+			else
+				export_columnar(out, rows);
+
+			if (!out.flush())
+				throw std::runtime_error("failed to write " + tmp.string());
+		}
+		std::filesystem::rename(tmp, file);
+	}
+
+	// Adds a written snapshot file to m_exportFiles, removing snapshots of older data
+	// and the least recently used ones above max_export_files
+	void remember_export(const std::filesystem::path &file, std::uint64_t seq)
+	{
+		std::error_code ec;
+		const auto current = m_changeLog.last_seq();
+
+		m_exportFiles.remove_if([&](const auto &e) {
+			if (e.first == current && e.second != file)
+				return false;
+			if (e.second != file)
+				std::filesystem::remove(e.second, ec);
+			return true;
+		});
+
+		// The data changed while the file was written
+		if (seq != current)
+		{
+			std::filesystem::remove(file, ec);
+			return;
+		}
+
+		m_exportFiles.emplace_front(seq, file);
+		while (m_exportFiles.size() > max_export_files)
+		{
+			std::filesystem::remove(m_exportFiles.back().second, ec);
+			m_exportFiles.pop_back();
+		}
+	}
+
+	// Removes snapshot files left by earlier runs of the server
+	static void remove_old_exports()
+	{
+		std::error_code ec;
+		for (const auto & entry : std::filesystem::directory_iterator(export_dir, ec))
+		{
+			if (0 == entry.path().filename().string().rfind("weather-", 0))
+				std::filesystem::remove(entry.path(), ec);
+		}
+	}
+
+	// Largest number of WebSocket-clients at a time
+	static constexpr std::size_t max_ws_connections = 500;
+
+	// Clients not seen for this long lose their rate limit state
+	static constexpr std::chrono::minutes admission_idle{5};
+
+	// Rate limits for reads, writes and WebSocket-upgrades, per client IP and for the whole server
+	admission_control_t m_admission;
+
+	void schedule_heartbeat()
+	{
+		m_heartbeatTimer.expires_after(heartbeat_interval);
+		m_heartbeatTimer.async_wait([this](const auto &ec) {
+			if (ec)
+				return;
+
+			{
+				std::lock_guard<std::mutex> lock{m_lock};
+				on_heartbeat();
+			}
+			schedule_heartbeat();
+		});
+	}
+
+	// Pings idle WebSocket-clients and reaps those that didn't answer the last ping.
+	void on_heartbeat()
+	{
+		const auto now = std::chrono::steady_clock::now();
+		m_admission.evict_idle(now, admission_idle);
+
+		for (auto it = m_registry.begin(); it != m_registry.end(); )
+		{
+			auto & client = it->second;
+			if (client.m_pingSent && now - *client.m_pingSent > heartbeat_pong_timeout)
+			{
+				client.m_handle->kill();
+				m_alerts.remove_connection(it->first);
+				it = m_registry.erase(it);
+				++m_reaped;
+				continue;
+			}
+
+			if (!client.m_pingSent && now - client.m_lastSeen > heartbeat_idle)
+			{
+				client.m_handle->send_message(rws::final_frame, rws::opcode_t::ping_frame, std::string{});
+				client.m_pingSent = now;
+			}
+			++it;
+		}
+	}
+
 	// Send message to all connected WebSocket-clients.
     void sendMessage(std::string message)
     {
         for (auto [k, v] : m_registry)
-            v -> send_message(rws::final_frame, rws::opcode_t::text_frame, message);
+            v.m_handle -> send_message(rws::final_frame, rws::opcode_t::text_frame, message);
     }
+
+	// Stamps a change with the next sequence number, logs it and sends it to all WebSocket-clients.
+	// Returns the sequence number, which is also the new version of the record.
+	std::uint64_t record_change(std::string op, std::size_t index, weatherStation_t record)
+	{
+		const auto & change = m_changeLog.append(
+			std::move(op), static_cast<std::uint32_t>(index), std::move(record));
+		m_snapshot.reset();
+
+		sendMessage(fmt::format(R"({{"Type":"change","Token":"{}","Change":{}}})",
+			seq_token_t{m_run, change.m_Seq}.to_string(), json_dto::to_json(change)));
+
+		return change.m_Seq;
+	}
+
+	// Evaluates the standing queries for a new reading and sends alerts to the subscribed WebSocket-clients.
+	void evaluate_alerts(const weatherStation_t &reading)
+	{
+		m_alerts.evaluate(reading, [&](const standingQuery_t &query, const auto &subscribers, float value) {
+			const alert_t alert{query.m_QueryID, reading.m_ID, query.m_Field, value, reading};
+			const auto message = fmt::format(R"({{"Type":"alert","Alert":{}}})", json_dto::to_json(alert));
+
+			for (const auto connection : subscribers)
+			{
+				auto it = m_registry.find(connection);
+				if (it != m_registry.end())
+					it->second.m_handle->send_message(rws::final_frame, rws::opcode_t::text_frame, message);
+			}
+		});
+	}
+
+	// Handles "subscribe <QueryID>" and "unsubscribe <QueryID>" from a WebSocket-client.
+	// Returns false if the message isn't one of them.
+	bool on_alert_command(const rws::ws_handle_t &wsh, const std::string &payload)
+	{
+		const bool subscribe = 0 == payload.rfind("subscribe ", 0);
+		if (!subscribe && 0 != payload.rfind("unsubscribe ", 0))
+			return false;
+
+		std::string reply;
+		try
+		{
+			const auto queryID = restinio::cast_to<std::uint32_t>(payload.substr(payload.find(' ') + 1));
+			if (!subscribe)
+				m_alerts.unsubscribe(queryID, wsh->connection_id());
+
+			reply = subscribe && !m_alerts.subscribe(queryID, wsh->connection_id()) ?
+				fmt::format(R"({{"Type":"error","QueryID":{}}})", queryID) :
+				fmt::format(R"({{"Type":"{}","QueryID":{}}})", subscribe ? "subscribed" : "unsubscribed", queryID);
+		}
+		catch (const std::exception &)
+		{
+			reply = R"({"Type":"error"})";
+		}
+
+		wsh->send_message(rws::final_frame, rws::opcode_t::text_frame, reply);
+		return true;
+	}
+
+	// Sends the current token to a new client, or the changes after since to a reconnecting client.
+	// If they are no longer in the log, or since is from another run of the server, a snapshot of the
+	// collection is sent instead, and the client continues from the snapshot's token with the live changes.
+	void send_resume(const rws::ws_handle_t &wsh, const std::optional<seq_token_t> &since)
+	{
+		std::string message;
+		if (!since)
+		{
+			message = fmt::format(R"({{"Type":"hello","Token":"{}"}})", current_token().to_string());
+		}
+		else if (since->m_run == m_run && m_changeLog.covers(since->m_seq))
+		{
+			message = fmt::format(R"({{"Type":"replay","Token":"{}","Changes":{}}})",
+				current_token().to_string(), json_dto::to_json(m_changeLog.since(since->m_seq)));
+		}
+		else
+		{
+			// Serializing only once per sequence number keeps reconnect storms cheap.
+			if (!m_snapshot)
+				m_snapshot = to_json(m_weatherStation);
+
+			message = fmt::format(R"({{"Type":"snapshot","Token":"{}","Records":{}}})",
+				current_token().to_string(), *m_snapshot);
+		}
+
+		wsh->send_message(rws::final_frame, rws::opcode_t::text_frame, message);
+	}
+
+	// Thread writing the snapshot files for '/export', declared last so it stops before the rest is destroyed
+	restinio::asio_ns::thread_pool m_exportPool{1};
 };
 
 // Function to handle server data
-auto server_handler(weatherStation_collection_t &weatherStation_collection)
+auto server_handler(std::shared_ptr<weatherStation_handler_t> handler)
 {
     auto router = std::make_unique<router_t>();
-    auto handler = std::make_shared<weatherStation_handler_t>(std::ref(weatherStation_collection));
 
+    // Binds a handler-function, with admission control in front of it
     auto by = [&](auto method) {
         using namespace std::placeholders;
-        return std::bind(method, handler, _1, _2);
+        return [handler, h = std::bind(method, handler, _1, _2)](const restinio::request_handle_t &req, rr::route_params_t params) {
+            std::lock_guard<std::mutex> lock{handler->mutex()};
+            if (!handler->admit(req))
+                return restinio::request_accepted();
+            return h(req, std::move(params));
+        };
     };
 
 	auto method_not_allowed = []( const auto & req, auto ) {
@@ -342,6 +2481,29 @@ auto server_handler(weatherStation_collection_t &weatherStation_collection)
 	router->http_get( "/Date/:Date", by( &weatherStation_handler_t::on_weatherStation_getDate ) );
 	router->add_handler(restinio::http_method_options(), "/Date/:Date", by(&weatherStation_handler_t::weatherStation_options));
 
+	// Handlers for '/percentiles/:ID' path
+	router->http_get("/percentiles/:ID", by(&weatherStation_handler_t::on_weatherStation_percentiles));
+	router->add_handler(restinio::http_method_options(), "/percentiles/:ID", by(&weatherStation_handler_t::weatherStation_options));
+
+	// Handlers for '/export' path
+	router->http_get("/export", by(&weatherStation_handler_t::on_weatherStation_export));
+	router->add_handler(restinio::http_method_options(), "/export", by(&weatherStation_handler_t::weatherStation_options));
+
+	// Handlers for '/query' path
+	router->http_get("/query", by(&weatherStation_handler_t::on_weatherStation_query));
+	router->add_handler(restinio::http_method_options(), "/query", by(&weatherStation_handler_t::weatherStation_options));
+
+	// Handlers for '/changes' path
+	router->http_get("/changes", by(&weatherStation_handler_t::on_weatherStation_changes));
+	router->add_handler(restinio::http_method_options(), "/changes", by(&weatherStation_handler_t::weatherStation_options));
+
+	// Handlers for '/alerts' path
+	router->http_post("/alerts", by(&weatherStation_handler_t::on_alert_add));
+	router->http_get("/alerts", by(&weatherStation_handler_t::on_alert_list));
+	router->http_delete(R"(/alerts/:QID(\d+))", by(&weatherStation_handler_t::on_alert_delete));
+	router->add_handler(restinio::http_method_options(), "/alerts", by(&weatherStation_handler_t::weatherStation_options));
+	router->add_handler(restinio::http_method_options(), R"(/alerts/:QID(\d+))", by(&weatherStation_handler_t::weatherStation_options));
+
 	// Handlers for '/id/:ID' path
 	router->http_put( "/id/:ID", by( &weatherStation_handler_t::on_weatherStation_addUpdate));
 	router->http_put( R"(/:ID(\d+))", by( &weatherStation_handler_t::on_weatherStation_addUpdate)); // added for client interaction
@@ -350,6 +2512,9 @@ auto server_handler(weatherStation_collection_t &weatherStation_collection)
 	// Handler for WebSocket
     router->http_get("/chat", by(&weatherStation_handler_t::on_weatherStation_liveUpdate)); // Routing for WebSocket
 
+	// Handler for WebSocket-connection counts
+    router->http_get("/connections", by(&weatherStation_handler_t::on_connections_stats));
+
 	// Handler for delete
     router->http_delete(R"(/:ID(\d+))", by(&weatherStation_handler_t::on_weatherStation_delete));
 
@@ -364,33 +2529,99 @@ auto server_handler(weatherStation_collection_t &weatherStation_collection)
     return router;
 }
 
-// Main-function
-int main()
+// Main-function. The optional argument is the number of acceptors, see below.
+int main(int argc, char *argv[])
 {
     using namespace std::chrono;
 
     try
     {
-        // Defining traits for restinio server
-        using traits_t =
-            restinio::traits_t<
-                restinio::asio_timer_manager_t,
-                restinio::single_threaded_ostream_logger_t,
-                router_t>;
+        // More than one acceptor runs each on its own thread, all bound to the same port with SO_REUSEPORT,
+        // so the kernel spreads new connections across them. They share the routes and the store, and the
+        // handler runs everything under one mutex, so only accepting and HTTP parsing happen in parallel.
+        std::size_t acceptors = 1;
+        if (argc > 1)
+        {
+            const std::string_view arg{argv[1]};
+            const auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), acceptors);
+            if (ec != std::errc{} || end != arg.data() + arg.size())
+                throw std::invalid_argument(fmt::format("number of acceptors must be a whole number, got '{}'", arg));
+        }
+
+        const std::size_t max_acceptors = std::max(1u, std::thread::hardware_concurrency());
+        if (0 == acceptors || acceptors > max_acceptors)
+            throw std::invalid_argument(fmt::format("number of acceptors must be between 1 and {}", max_acceptors));
+#if !defined(SO_REUSEPORT)
+        if (acceptors > 1)
+            throw std::invalid_argument("more than one acceptor needs SO_REUSEPORT");
+#endif
+
+        // Largest number of connections at a time, new ones wait in the accept queue
+        constexpr std::size_t max_parallel_connections = 1000;
 
         // Initial weather data
         weatherStation_collection_t weatherStation_collection{
             {"1", "20231207", "12:15", "Aarhus N", "13.692", "19.438", 13.1, 70}
         };
 
-        // Run restinio server with initialised traits and configuration
-        restinio::run(
-            restinio::on_this_thread<traits_t>()
+        // One io_context per acceptor, the first is also used for the WebSocket heartbeat timer
+        std::vector<std::unique_ptr<restinio::asio_ns::io_context>> contexts;
+        for (std::size_t i = 0; i < acceptors; ++i)
+            contexts.push_back(std::make_unique<restinio::asio_ns::io_context>());
+
+        auto handler = std::make_shared<weatherStation_handler_t>(std::ref(weatherStation_collection), std::ref(*contexts.front()));
+
+        // Restinio configuration for one acceptor
+        const auto settings = [&] {
+            return restinio::on_this_thread<traits_t>()
                 .address("localhost")
-                .request_handler(server_handler(weatherStation_collection))
+                .request_handler(server_handler(handler))
+                .max_parallel_connections(std::max<std::size_t>(1, max_parallel_connections / acceptors))
+                .acceptor_options_setter([acceptors](restinio::acceptor_options_t &options) {
+                    options.set_option(restinio::asio_ns::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+                    if (acceptors > 1)
+                        options.set_option(restinio::asio_ns::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+                })
                 .read_next_http_message_timelimit(10s)
                 .write_http_response_timelimit(1s)
-                .handle_request_timeout(1s));
+                // Exports are answered from the export thread once their file is written
+                .handle_request_timeout(60s);
+        };
+
+        // Run the other acceptors on their own threads
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < acceptors; ++i)
+        {
+            threads.emplace_back([&, i] {
+                try
+                {
+                    restinio::run(*contexts[i], settings());
+                }
+                catch (const std::exception &ex)
+                {
+                    std::cerr << "Error in acceptor " << i << ": " << ex.what() << std::endl;
+                }
+            });
+        }
+
+        // Run restinio server with initialised traits and configuration, stopping the other acceptors if it fails
+        try
+        {
+            restinio::run(*contexts.front(), settings());
+        }
+        catch (...)
+        {
+            for (auto & ctx : contexts)
+                ctx->stop();
+            for (auto & t : threads)
+                t.join();
+            throw;
+        }
+
+        for (auto & t : threads)
+            t.join();
     }
     catch (const std::exception &ex)
     {